@@ -1,17 +1,53 @@
+#define _GNU_SOURCE  // struct ucred for SO_PEERCRED
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
 #include <ctype.h>
+#include <time.h>
 #include <asm-generic/socket.h>
+#include "shm_ring.h"
 
 #define PLAYER1_PORT 2201
 #define PLAYER2_PORT 2202
+#define PLAYER1_SOCK_PATH "/tmp/hw4_player1.sock"
+#define PLAYER2_SOCK_PATH "/tmp/hw4_player2.sock"
+#define PLAYER1_SHM_PATH "/tmp/hw4_player1_shm.sock"
+#define PLAYER2_SHM_PATH "/tmp/hw4_player2_shm.sock"
+#define HANDOFF_SOCK_PATH "/tmp/hw4_handoff.sock"
+#define HANDOFF_MAGIC 0x48573448
+#define HANDOFF_VERSION 2
+#define HANDOFF_HELLO_TIMEOUT_MS 100
+#define HANDOFF_TIMEOUT_MS 2000
 #define BUFFER_SIZE 1024
 #define MAX_SHIPS 5
 
+// Per-connection packet rate limit (token bucket); a rate of 0 disables it.
+// A client over the limit isn't read from until it has a token again, so
+// its packets wait in the socket and it is slowed down rather than cut off.
+#ifndef RATE_LIMIT_PER_SEC
+#define RATE_LIMIT_PER_SEC 1000
+#endif
+#ifndef RATE_LIMIT_BURST
+#define RATE_LIMIT_BURST 100
+#endif
+
+// Error replies in a row before a player is made to forfeit
+#ifndef MAX_CONSECUTIVE_ERRORS
+#define MAX_CONSECUTIVE_ERRORS 50
+#endif
+
 // Structure to track ship movements for validation
 typedef struct {
     char* rotations[7][4];  // [shape][rotation]
@@ -250,18 +286,273 @@ int validate_init_values(int* values, int width, int height) {
     return 0;
 }
 
-int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* buffer) {
+// Setup phases a connection moves through before play starts
+typedef enum {
+    PHASE_BEGIN,
+    PHASE_INITIALIZE,
+    PHASE_READY
+} SetupPhase;
+
+// Per-player connection state
+typedef struct {
+    int fd;  // Client socket; the control socket for shared-memory clients
+    int player;
+    SetupPhase phase;
+    
+    // Shared-memory ring transport; channel is NULL for socket clients
+    ShmChannel* channel;
+    int shm_fd;       // memfd holding the channel
+    int rx_event_fd;  // Counted by the client once per packet it queues
+    int tx_event_fd;  // Counted by us once per packet we queue
+    
+    // Token bucket rate limiting
+    double tokens;
+    struct timespec last_refill;
+    int throttled;
+    int consecutive_errors;
+    
+    // Counters reported when the match ends
+    unsigned long packets_received;
+    unsigned long times_throttled;
+    unsigned long errors_sent;
+} Connection;
+
+void init_connection(Connection* conn, int fd, int player) {
+    memset(conn, 0, sizeof(Connection));
+    conn->fd = fd;
+    conn->player = player;
+    conn->phase = PHASE_BEGIN;
+    conn->shm_fd = conn->rx_event_fd = conn->tx_event_fd = -1;
+    conn->tokens = RATE_LIMIT_BURST;
+    clock_gettime(CLOCK_MONOTONIC, &conn->last_refill);
+}
+
+// Refill the bucket for the time elapsed since the last refill
+void refill_tokens(Connection* conn) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - conn->last_refill.tv_sec) +
+                     (now.tv_nsec - conn->last_refill.tv_nsec) / 1e9;
+    conn->last_refill = now;
+    
+    conn->tokens += elapsed * RATE_LIMIT_PER_SEC;
+    if(conn->tokens > RATE_LIMIT_BURST) {
+        conn->tokens = RATE_LIMIT_BURST;
+    }
+}
+
+// Milliseconds until the connection may send its next packet, or 0 if it
+// may send one now. Callers leave the fd out of poll() until then.
+int token_wait_ms(Connection* conn) {
+#if RATE_LIMIT_PER_SEC <= 0
+    (void)conn;
+    return 0;
+#else
+    refill_tokens(conn);
+    if(conn->tokens >= 1) {
+        conn->throttled = 0;
+        return 0;
+    }
+    
+    if(!conn->throttled) {
+        conn->throttled = 1;
+        if(conn->times_throttled++ == 0) {
+            fprintf(stderr, "[Server] Player %d is over the rate limit, throttling\n",
+                    conn->player);
+        }
+    }
+    return (int)((1 - conn->tokens) * 1000 / RATE_LIMIT_PER_SEC) + 1;
+#endif
+}
+
+// Map a shared-memory channel and take ownership of its descriptors
+int attach_shm_channel(Connection* conn, int shm_fd, int rx_event_fd, int tx_event_fd) {
+    void* channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(channel == MAP_FAILED) {
+        return -1;
+    }
+    conn->channel = channel;
+    conn->shm_fd = shm_fd;
+    conn->rx_event_fd = rx_event_fd;
+    conn->tx_event_fd = tx_event_fd;
+    return 0;
+}
+
+void close_shm_channel(Connection* conn) {
+    if(conn->channel) {
+        munmap(conn->channel, sizeof(ShmChannel));
+        close(conn->shm_fd);
+        close(conn->rx_event_fd);
+        close(conn->tx_event_fd);
+    }
+    conn->channel = NULL;
+    conn->shm_fd = conn->rx_event_fd = conn->tx_event_fd = -1;
+}
+
+// Give a client that connected on a shared-memory listener its rings: a
+// memfd with both of them, an eventfd it counts once per packet it sends
+// us, and one we count once per reply. Returns 0 on success.
+int create_shm_channel(Connection* conn, int client_fd) {
+    int shm_fd = memfd_create("hw4_ring", MFD_CLOEXEC);
+    int rx_event_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    int tx_event_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    
+    if(shm_fd < 0 || rx_event_fd < 0 || tx_event_fd < 0 ||
+       ftruncate(shm_fd, sizeof(ShmChannel)) < 0 ||
+       attach_shm_channel(conn, shm_fd, rx_event_fd, tx_event_fd) < 0) {
+        if(shm_fd >= 0) close(shm_fd);
+        if(rx_event_fd >= 0) close(rx_event_fd);
+        if(tx_event_fd >= 0) close(tx_event_fd);
+        return -1;
+    }
+    
+    int passed[3] = { shm_fd, rx_event_fd, tx_event_fd };
+    char control[CMSG_SPACE(sizeof(passed))];
+    char tag = 'R';
+    struct iovec iov = { &tag, 1 };
+    struct msghdr msg;
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(passed));
+    memcpy(CMSG_DATA(cmsg), passed, sizeof(passed));
+    
+    if(sendmsg(client_fd, &msg, MSG_NOSIGNAL) != 1) {
+        close_shm_channel(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// Send one packet over whichever transport the client uses
+void send_packet(Connection* conn, const char* packet, size_t length) {
+    if(conn->channel == NULL) {
+        send(conn->fd, packet, length, 0);
+        return;
+    }
+    
+    // A client that stops draining its ring loses replies, much as its
+    // socket would eventually stop accepting them
+    if(shm_ring_push(&conn->channel->to_client, packet, length) == 0) {
+        uint64_t one = 1;
+        if(write(conn->tx_event_fd, &one, sizeof(one)) < 0) {
+            perror("Ring wakeup failed");
+        }
+    }
+}
+
+// Fill the two poll() entries for a connection: where its packets arrive
+// and, for shared-memory clients, the control socket that reports hangups.
+// A connection that shouldn't be read from yet gets both entries disabled.
+void watch_connection(Connection* conn, struct pollfd* fds, int enabled) {
+    fds[0].fd = !enabled ? -1 : conn->channel ? conn->rx_event_fd : conn->fd;
+    fds[1].fd = enabled && conn->channel ? conn->fd : -1;
+    fds[0].events = fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+}
+
+// Read one packet into buffer as a NUL-terminated string, spending a token,
+// after watch_connection()'s entries in fds polled ready. Returns 1 if a
+// packet was read, 0 if there was none after all, or -1 if the client
+// disconnected.
+int read_packet(Connection* conn, char* buffer, struct pollfd* fds) {
+    if(RATE_LIMIT_PER_SEC > 0) {
+        conn->tokens--;
+    }
+    
+    if(conn->channel == NULL) {
+        int bytes_read = read(conn->fd, buffer, BUFFER_SIZE - 1);
+        if(bytes_read <= 0) {
+            return -1;
+        }
+        conn->packets_received++;
+        buffer[bytes_read] = '\0';
+        return 1;
+    }
+    
+    // Shared-memory clients never write to the control socket, so anything
+    // showing up there means they are gone
+    if(fds[1].revents) {
+        return -1;
+    }
+    
+    uint64_t count;
+    if(!(fds[0].revents & POLLIN) || read(conn->rx_event_fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    int length = shm_ring_pop(&conn->channel->to_server, buffer, BUFFER_SIZE);
+    if(length == -2) {
+        return -1;  // Corrupted ring
+    }
+    if(length < 0) {
+        return 0;  // A wakeup without a packet
+    }
+    conn->packets_received++;
+    return 1;
+}
+
+// Block until the connection sends a packet. Returns -1 if it disconnects.
+int wait_packet(Connection* conn, char* buffer) {
+    struct pollfd fds[2];
+    while(1) {
+        watch_connection(conn, fds, 1);
+        if(poll(fds, 2, -1) < 0) {
+            return -1;
+        }
+        int result = read_packet(conn, buffer, fds);
+        if(result != 0) {
+            return result;
+        }
+    }
+}
+
+void count_error(Connection* conn) {
+    conn->errors_sent++;
+    conn->consecutive_errors++;
+}
+
+void send_error(Connection* conn, const char* packet) {
+    send_packet(conn, packet, strlen(packet));
+    count_error(conn);
+}
+
+// Forfeit a player who has sent too many invalid packets in a row; the
+// packet after the last error is answered with the halt instead
+int check_error_limit(Connection* conn, Connection* other) {
+    if(conn->consecutive_errors < MAX_CONSECUTIVE_ERRORS) {
+        return 0;
+    }
+    fprintf(stderr, "[Server] Player %d forfeits after %d consecutive errors\n",
+            conn->player, conn->consecutive_errors);
+    send_packet(conn, "H 0", 3);
+    send_packet(other, "H 1", 3);
+    return 1;
+}
+
+void print_connection_stats(Connection* conn) {
+    fprintf(stderr, "[Server] Player %d: %lu packets, throttled %lu times, %lu errors\n",
+            conn->player, conn->packets_received, conn->times_throttled, conn->errors_sent);
+}
+
+int handle_initialize(Connection* conn, GameState* state, ShipMoves* moves, char* buffer) {
     int values[20];
     
     // Check packet type
     if(buffer[0] != 'I') {
-        send(client_fd, "E 101", 5, 0);
+        send_packet(conn, "E 101", 5);
         return -1;
     }
     
     // Check format
     if(!validate_init_packet(buffer)) {
-        send(client_fd, "E 201", 5, 0);
+        send_packet(conn, "E 201", 5);
         return -1;
     }
     
@@ -274,14 +565,14 @@ int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* b
     }
     
     if(count != 20) {
-        send(client_fd, "E 201", 5, 0);
+        send_packet(conn, "E 201", 5);
         return -1;
     }
 
     // Validate all shapes first (300)
     for(int i = 0; i < 20; i += 4) {
         if(values[i] < 1 || values[i] > 7) {
-            send(client_fd, "E 300", 5, 0);
+            send_packet(conn, "E 300", 5);
             return -1;
         }
     }
@@ -289,7 +580,7 @@ int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* b
     // Validate all rotations (301)
     for(int i = 0; i < 20; i += 4) {
         if(values[i + 1] < 1 || values[i + 1] > 4) {
-            send(client_fd, "E 301", 5, 0);
+            send_packet(conn, "E 301", 5);
             return -1;
         }
     }
@@ -303,7 +594,7 @@ int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* b
         
         // Initial position check
         if(row < 0 || row >= state->height || col < 0 || col >= state->width) {
-            send(client_fd, "E 302", 5, 0);
+            send_packet(conn, "E 302", 5);
             return -1;
         }
         
@@ -322,7 +613,7 @@ int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* b
             
             if(test_row < 0 || test_row >= state->height || 
                test_col < 0 || test_col >= state->width) {
-                send(client_fd, "E 302", 5, 0);
+                send_packet(conn, "E 302", 5);
                 return -1;
             }
         }
@@ -333,7 +624,7 @@ int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* b
         int result = place_ship(state, moves, values[i], values[i+1], 
                               values[i+2], values[i+3], (i/4) + 1);
         if(result == 303) {
-            send(client_fd, "E 303", 5, 0);
+            send_packet(conn, "E 303", 5);
             // Clear board
             for(int j = 0; j < state->height; j++) {
                 memset(state->board[j], 0, state->width * sizeof(int));
@@ -342,16 +633,640 @@ int handle_initialize(int client_fd, GameState* state, ShipMoves* moves, char* b
         }
     }
     
-    send(client_fd, "A", 1, 0);
+    send_packet(conn, "A", 1);
+    return 0;
+}
+
+// Handle one packet from a player still in the Begin phase.
+// Returns 1 once the player has begun, 0 to keep waiting, -1 on forfeit.
+int handle_begin(Connection* conn, Connection* other, GameState** player1_state,
+                 GameState** player2_state, char* buffer) {
+    if(buffer[0] == 'F') {
+        send_packet(conn, "H 0", 3);
+        send_packet(other, "H 1", 3);
+        return -1;
+    }
+    
+    if(buffer[0] != 'B') {
+        send_error(conn, "E 100");
+        return 0;
+    }
+    
+    if(conn->player == 1) {
+        // Player 1 chooses the board dimensions
+        int width, height;
+        char extra;
+        int params = sscanf(buffer, "B %d %d%c", &width, &height, &extra);
+        if(params != 2 || buffer[1] != ' ') {
+            send_error(conn, "E 200");
+            return 0;
+        }
+        
+        if(width < 10 || height < 10) {
+            send_error(conn, "E 200");
+            return 0;
+        }
+        
+        *player1_state = create_game_state(width, height);
+        *player2_state = create_game_state(width, height);
+    } else if(strlen(buffer) > 1) {
+        send_error(conn, "E 200");
+        return 0;
+    }
+    
+    conn->consecutive_errors = 0;
+    send_packet(conn, "A", 1);
+    return 1;
+}
+
+// Read and handle one setup packet from a connection, advancing its phase.
+// Returns 0 to continue setup, -1 if the match is over.
+int handle_setup_packet(Connection* conn, Connection* other, GameState** player1_state,
+                        GameState** player2_state, ShipMoves* moves, char* buffer,
+                        struct pollfd* fds) {
+    int read_result = read_packet(conn, buffer, fds);
+    if(read_result < 0) {
+        send_packet(other, "H 1", 3);  // The player disconnected
+        return -1;
+    }
+    if(read_result == 0) {
+        return 0;
+    }
+    
+    if(check_error_limit(conn, other)) {
+        return -1;
+    }
+    
+    if(conn->phase == PHASE_BEGIN) {
+        int result = handle_begin(conn, other, player1_state, player2_state, buffer);
+        if(result < 0) return -1;
+        if(result > 0) conn->phase = PHASE_INITIALIZE;
+        return 0;
+    }
+    
+    if(strcmp(buffer, "F") == 0) {
+        send_packet(conn, "H 0", 3);
+        send_packet(other, "H 1", 3);
+        return -1;
+    }
+    
+    GameState* state = (conn->player == 1) ? *player1_state : *player2_state;
+    if(handle_initialize(conn, state, moves, buffer) == 0) {
+        conn->phase = PHASE_READY;  // Successfully initialized
+        conn->consecutive_errors = 0;
+    } else {
+        count_error(conn);
+    }
+    return 0;
+}
+
+// Descriptors passed to the new process during a handoff, in this order.
+// Shared-memory clients also pass their ring and its two eventfds; the
+// rings themselves live in the memfd, so no ring state needs copying.
+enum {
+    HANDOFF_SERVER1,
+    HANDOFF_SERVER2,
+    HANDOFF_UNIX1,
+    HANDOFF_UNIX2,
+    HANDOFF_SHM1,
+    HANDOFF_SHM2,
+    HANDOFF_LISTENER,
+    HANDOFF_CLIENT1,
+    HANDOFF_CLIENT2,
+    HANDOFF_CLIENT1_RING,
+    HANDOFF_CLIENT1_RX_EVENT,
+    HANDOFF_CLIENT1_TX_EVENT,
+    HANDOFF_CLIENT2_RING,
+    HANDOFF_CLIENT2_RX_EVENT,
+    HANDOFF_CLIENT2_TX_EVENT,
+    HANDOFF_FD_COUNT
+};
+
+// Returned by accept_either() when a new server process is waiting to take over
+#define ACCEPT_HANDOFF -2
+
+// Sent first by the new server process to identify itself
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t snapshot_size;  // sizeof(MatchSnapshot) in the new binary
+    int32_t pid;             // Must match the connecting process
+} HandoffHello;
+
+// Everything a new server process needs to resume a live match. The boards
+// follow it on the handoff socket as one byte per cell, player 1's first.
+// Any change to this layout must bump HANDOFF_VERSION.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t snapshot_size;  // sizeof(MatchSnapshot) in the old binary
+    uint32_t fd_mask;        // Bit i set if socket i of the HANDOFF_* order was passed
+    int64_t sent_at_ns;      // CLOCK_MONOTONIC, for measuring the handoff pause
+    int32_t width;           // 0 if player 1 hasn't begun and no boards exist yet
+    int32_t height;
+    int32_t ships_remaining[2];
+    int32_t phase[2];
+    int32_t consecutive_errors[2];
+    int32_t current_player;
+    uint32_t reserved;       // Keeps the 64-bit counters aligned
+    uint64_t packets_received[2];
+    uint64_t times_throttled[2];
+    uint64_t errors_sent[2];
+} MatchSnapshot;
+
+int64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int send_all(int fd, const char* data, size_t length) {
+    while(length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if(sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
     return 0;
 }
 
-int main() {
-    int server1_fd, server2_fd, client1_fd, client2_fd;
+// Pack a board into one byte per cell; cells only hold -2..MAX_SHIPS
+void pack_board(GameState* state, signed char* cells) {
+    for(int i = 0; i < state->height; i++) {
+        for(int j = 0; j < state->width; j++) {
+            *cells++ = (signed char)state->board[i][j];
+        }
+    }
+}
+
+void unpack_board(GameState* state, const signed char* cells) {
+    for(int i = 0; i < state->height; i++) {
+        for(int j = 0; j < state->width; j++) {
+            state->board[i][j] = *cells++;
+        }
+    }
+}
+
+// Bound every step of the handoff exchange so a stalled peer can't hang
+// the match
+void set_handoff_deadline(int fd, int timeout_ms) {
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Only a process of the same user may take part in a handoff. If pid isn't
+// 0 the peer must also be that process. Returns 0 if the peer is trusted.
+int check_handoff_peer(int fd, pid_t pid) {
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0) {
+        return -1;
+    }
+    if(cred.uid != getuid() || (pid != 0 && cred.pid != pid)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Hand the match over to a new server process connecting on the handoff
+// socket. The peer must identify itself first; only then are the sockets
+// passed with SCM_RIGHTS, followed by the snapshot and boards.
+// Returns 0 once the new process has acknowledged, -1 to keep serving.
+int send_handoff(int handoff_fd, int fds[HANDOFF_FD_COUNT], GameState* player1_state,
+                 GameState* player2_state, Connection conns[2], int current_player) {
+    MatchSnapshot snapshot;
+    HandoffHello hello;
+    int passed[HANDOFF_FD_COUNT];
+    int count = 0;
+    
+    int peer_fd = accept(handoff_fd, NULL, NULL);
+    if(peer_fd < 0) {
+        return -1;
+    }
+    // A real takeover sends its hello right after connecting, so anything
+    // slower is turned away before the match stalls noticeably
+    set_handoff_deadline(peer_fd, HANDOFF_HELLO_TIMEOUT_MS);
+    
+    if(recv(peer_fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+       hello.magic != HANDOFF_MAGIC) {
+        fprintf(stderr, "[Server] Handoff peer didn't identify itself\n");
+        close(peer_fd);
+        return -1;
+    }
+    if(hello.version != HANDOFF_VERSION || hello.snapshot_size != sizeof(MatchSnapshot)) {
+        fprintf(stderr, "[Server] Handoff peer speaks snapshot version %u (%u bytes), "
+                "expected %u (%zu bytes)\n", hello.version, hello.snapshot_size,
+                HANDOFF_VERSION, sizeof(MatchSnapshot));
+        close(peer_fd);
+        return -1;
+    }
+    if(hello.pid <= 0 || check_handoff_peer(peer_fd, hello.pid) < 0) {
+        fprintf(stderr, "[Server] Handoff peer rejected by credentials\n");
+        close(peer_fd);
+        return -1;
+    }
+    set_handoff_deadline(peer_fd, HANDOFF_TIMEOUT_MS);
+    
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.magic = HANDOFF_MAGIC;
+    snapshot.version = HANDOFF_VERSION;
+    snapshot.snapshot_size = sizeof(MatchSnapshot);
+    snapshot.sent_at_ns = monotonic_ns();
+    for(int i = 0; i < HANDOFF_FD_COUNT; i++) {
+        if(fds[i] >= 0) {
+            snapshot.fd_mask |= 1u << i;
+            passed[count++] = fds[i];
+        }
+    }
+    if(player1_state) {
+        snapshot.width = player1_state->width;
+        snapshot.height = player1_state->height;
+        snapshot.ships_remaining[0] = player1_state->ships_remaining;
+        snapshot.ships_remaining[1] = player2_state->ships_remaining;
+    }
+    for(int i = 0; i < 2; i++) {
+        snapshot.phase[i] = conns[i].phase;
+        snapshot.consecutive_errors[i] = conns[i].consecutive_errors;
+        snapshot.packets_received[i] = conns[i].packets_received;
+        snapshot.times_throttled[i] = conns[i].times_throttled;
+        snapshot.errors_sent[i] = conns[i].errors_sent;
+    }
+    snapshot.current_player = current_player;
+    
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FD_COUNT)];
+    struct iovec iov = { &snapshot, sizeof(snapshot) };
+    struct msghdr msg;
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), passed, sizeof(int) * count);
+    
+    if(sendmsg(peer_fd, &msg, MSG_NOSIGNAL) != sizeof(snapshot)) {
+        close(peer_fd);
+        return -1;
+    }
+    
+    if(player1_state) {
+        size_t cells = (size_t)snapshot.width * snapshot.height;
+        signed char* boards = malloc(2 * cells);
+        if(boards == NULL) {
+            close(peer_fd);
+            return -1;
+        }
+        pack_board(player1_state, boards);
+        pack_board(player2_state, boards + cells);
+        int result = send_all(peer_fd, (char*)boards, 2 * cells);
+        free(boards);
+        if(result < 0) {
+            close(peer_fd);
+            return -1;
+        }
+    }
+    
+    // Wait for the new process to confirm it owns the match
+    char ack = 0;
+    if(read(peer_fd, &ack, 1) != 1 || ack != 'A') {
+        close(peer_fd);
+        return -1;
+    }
+    
+    close(peer_fd);
+    return 0;
+}
+
+void close_fds(int* fds, int count) {
+    for(int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+// Reject a snapshot whose state this server couldn't have produced. Boards
+// exist once player 1's B packet was accepted, and are held to the same
+// 10x10 minimum handle_begin() enforces.
+int validate_snapshot(const MatchSnapshot* snapshot) {
+    if(snapshot->current_player != 1 && snapshot->current_player != 2) {
+        return -1;
+    }
+    for(int i = 0; i < 2; i++) {
+        if(snapshot->phase[i] < PHASE_BEGIN || snapshot->phase[i] > PHASE_READY) {
+            return -1;
+        }
+    }
+    
+    int has_boards = snapshot->phase[0] != PHASE_BEGIN;
+    if(has_boards && (snapshot->width < 10 || snapshot->height < 10)) {
+        return -1;
+    }
+    if(!has_boards && (snapshot->width != 0 || snapshot->height != 0 ||
+                       snapshot->phase[1] == PHASE_READY)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Connect to the running server's handoff socket and take over its match.
+// Sockets the old process didn't have are returned as -1. Nothing is
+// acknowledged unless the snapshot and every promised socket arrived.
+int receive_handoff(int fds[HANDOFF_FD_COUNT], GameState** player1_state,
+                    GameState** player2_state, Connection conns[2], int* current_player) {
+    MatchSnapshot snapshot;
+    HandoffHello hello;
+    struct sockaddr_un addr;
+    int passed[HANDOFF_FD_COUNT];
+    int count = 0;
+    
+    int peer_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(peer_fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, HANDOFF_SOCK_PATH, sizeof(addr.sun_path) - 1);
+    if(connect(peer_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       check_handoff_peer(peer_fd, 0) < 0) {
+        close(peer_fd);
+        return -1;
+    }
+    set_handoff_deadline(peer_fd, HANDOFF_TIMEOUT_MS);
+    
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = HANDOFF_MAGIC;
+    hello.version = HANDOFF_VERSION;
+    hello.snapshot_size = sizeof(MatchSnapshot);
+    hello.pid = getpid();
+    if(send_all(peer_fd, (char*)&hello, sizeof(hello)) < 0) {
+        close(peer_fd);
+        return -1;
+    }
+    
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FD_COUNT)];
+    struct iovec iov = { &snapshot, sizeof(snapshot) };
+    struct msghdr msg;
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    ssize_t received = recvmsg(peer_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+       cmsg->cmsg_len >= CMSG_LEN(0)) {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        
+        // The control buffer's padding can fit more descriptors than we
+        // expect; never copy more than passed[] holds
+        if(count > HANDOFF_FD_COUNT) {
+            fprintf(stderr, "[Server] Handoff sent %d sockets, expected at most %d\n",
+                    count, HANDOFF_FD_COUNT);
+            for(int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                close(fd);
+            }
+            close(peer_fd);
+            return -1;
+        }
+        memcpy(passed, CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+    
+    if(received != sizeof(snapshot) || snapshot.magic != HANDOFF_MAGIC ||
+       snapshot.version != HANDOFF_VERSION || snapshot.snapshot_size != sizeof(MatchSnapshot)) {
+        fprintf(stderr, "[Server] Handoff snapshot doesn't match version %u (%zu bytes)\n",
+                HANDOFF_VERSION, sizeof(MatchSnapshot));
+        close_fds(passed, count);
+        close(peer_fd);
+        return -1;
+    }
+    
+    // Every socket the snapshot promises must have arrived; resuming without
+    // one would orphan a connected player
+    if((msg.msg_flags & MSG_CTRUNC) || count != __builtin_popcount(snapshot.fd_mask)) {
+        fprintf(stderr, "[Server] Handoff lost sockets\n");
+        close_fds(passed, count);
+        close(peer_fd);
+        return -1;
+    }
+    if(validate_snapshot(&snapshot) < 0) {
+        fprintf(stderr, "[Server] Handoff snapshot holds an invalid match state\n");
+        close_fds(passed, count);
+        close(peer_fd);
+        return -1;
+    }
+    for(int i = 0, next = 0; i < HANDOFF_FD_COUNT; i++) {
+        fds[i] = (snapshot.fd_mask & (1u << i)) ? passed[next++] : -1;
+    }
+    
+    for(int i = 0; i < 2; i++) {
+        int* ring = &fds[HANDOFF_CLIENT1_RING + 3 * i];
+        if(ring[0] < 0 && ring[1] < 0 && ring[2] < 0) {
+            continue;
+        }
+        if(ring[0] < 0 || ring[1] < 0 || ring[2] < 0 ||
+           attach_shm_channel(&conns[i], ring[0], ring[1], ring[2]) < 0) {
+            fprintf(stderr, "[Server] Handoff lost a shared-memory channel\n");
+            close_fds(passed, count);
+            close(peer_fd);
+            return -1;
+        }
+    }
+    
+    if(snapshot.width > 0) {
+        size_t cells = (size_t)snapshot.width * snapshot.height;
+        signed char* boards = malloc(2 * cells);
+        if(boards == NULL ||
+           recv(peer_fd, boards, 2 * cells, MSG_WAITALL) != (ssize_t)(2 * cells)) {
+            free(boards);
+            close_fds(passed, count);
+            close(peer_fd);
+            return -1;
+        }
+        *player1_state = create_game_state(snapshot.width, snapshot.height);
+        *player2_state = create_game_state(snapshot.width, snapshot.height);
+        unpack_board(*player1_state, boards);
+        unpack_board(*player2_state, boards + cells);
+        (*player1_state)->ships_remaining = snapshot.ships_remaining[0];
+        (*player2_state)->ships_remaining = snapshot.ships_remaining[1];
+        free(boards);
+    }
+    
+    for(int i = 0; i < 2; i++) {
+        conns[i].phase = snapshot.phase[i];
+        conns[i].consecutive_errors = snapshot.consecutive_errors[i];
+        conns[i].packets_received = snapshot.packets_received[i];
+        conns[i].times_throttled = snapshot.times_throttled[i];
+        conns[i].errors_sent = snapshot.errors_sent[i];
+    }
+    *current_player = snapshot.current_player;
+    
+    if(send(peer_fd, "A", 1, MSG_NOSIGNAL) != 1) {
+        // The old process may still be serving the match, so back off
+        if(*player1_state) free_game_state(*player1_state);
+        if(*player2_state) free_game_state(*player2_state);
+        *player1_state = *player2_state = NULL;
+        close_fds(passed, count);
+        close(peer_fd);
+        return -1;
+    }
+    close(peer_fd);
+    
+    fprintf(stderr, "[Server] Took over match after a %.3f ms handoff\n",
+            (monotonic_ns() - snapshot.sent_at_ns) / 1e6);
+    return 0;
+}
+
+// Create a listening Unix-domain socket for same-host clients.
+// Fails with EADDRINUSE if another server is still listening on path, and
+// with EEXIST if path is something other than a socket.
+int create_unix_listener(const char* path) {
+    struct sockaddr_un addr;
+    struct stat info;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // Only remove a stale socket file left behind by a previous run; if
+    // something still accepts connections on it, leave it alone
+    if(lstat(path, &info) == 0) {
+        if(!S_ISSOCK(info.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            return -1;
+        }
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        int saved_errno = errno;
+        close(fd);
+        if(saved_errno != ECONNREFUSED) {
+            errno = saved_errno;
+            return -1;
+        }
+        unlink(path);
+    } else if(errno != ENOENT) {
+        return -1;
+    }
+    
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Create a Unix listener during startup. Running without one is fine, but
+// another live server on the same path means this one must not start.
+int open_unix_listener(const char* path, const char* what) {
+    int fd = create_unix_listener(path);
+    if(fd < 0) {
+        int saved_errno = errno;
+        fprintf(stderr, "%s setup failed: %s\n", what, strerror(saved_errno));
+        if(saved_errno == EADDRINUSE) exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Accept the first client to arrive on the player's TCP, Unix or
+// shared-memory listener, setting up its rings in the last case.
+// Returns ACCEPT_HANDOFF instead if a new server process wants to take over.
+int accept_player(Connection* conn, int tcp_fd, int unix_fd, int shm_fd, int handoff_fd) {
+    struct pollfd fds[4];
+    fds[0].fd = tcp_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = unix_fd;  // Negative fds are ignored by poll()
+    fds[1].events = POLLIN;
+    fds[2].fd = shm_fd;
+    fds[2].events = POLLIN;
+    fds[3].fd = handoff_fd;
+    fds[3].events = POLLIN;
+
+    while(1) {
+        if(poll(fds, 4, -1) < 0) {
+            return -1;
+        }
+        if(fds[3].revents & POLLIN) {
+            return ACCEPT_HANDOFF;
+        }
+        for(int i = 0; i < 3; i++) {
+            if(fds[i].revents & POLLIN) {
+                int fd = accept(fds[i].fd, NULL, NULL);
+                if(fd < 0) {
+                    continue;
+                }
+                if(fds[i].fd == shm_fd && create_shm_channel(conn, fd) < 0) {
+                    perror("Shared-memory channel setup failed");
+                    close(fd);
+                    continue;
+                }
+                return fd;
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int server1_fd, server2_fd, client1_fd = -1, client2_fd = -1;
+    int unix1_fd, unix2_fd, shm1_fd, shm2_fd, handoff_fd;
     struct sockaddr_in addr1, addr2;
     char buffer[BUFFER_SIZE] = {0};
     GameState *player1_state = NULL, *player2_state = NULL;
     ShipMoves* ship_moves = init_ship_moves();
+    int current_player = 1;  // Start with player 1
+    int handed_off = 0;
+    Connection conns[2];
+    
+    init_connection(&conns[0], -1, 1);
+    init_connection(&conns[1], -1, 2);
+    
+    // A client that hangs up must only end its match, not kill the server
+    // before it can halt the other player and print the stats
+    signal(SIGPIPE, SIG_IGN);
+    
+    // A new server binary started with --takeover resumes the running
+    // server's match, inheriting its listening and client sockets
+    if(argc > 1 && strcmp(argv[1], "--takeover") == 0) {
+        int fds[HANDOFF_FD_COUNT];
+        if(receive_handoff(fds, &player1_state, &player2_state, conns, &current_player) < 0) {
+            fprintf(stderr, "Takeover failed\n");
+            exit(EXIT_FAILURE);
+        }
+        server1_fd = fds[HANDOFF_SERVER1];
+        server2_fd = fds[HANDOFF_SERVER2];
+        unix1_fd = fds[HANDOFF_UNIX1];
+        unix2_fd = fds[HANDOFF_UNIX2];
+        shm1_fd = fds[HANDOFF_SHM1];
+        shm2_fd = fds[HANDOFF_SHM2];
+        handoff_fd = fds[HANDOFF_LISTENER];
+        client1_fd = fds[HANDOFF_CLIENT1];
+        client2_fd = fds[HANDOFF_CLIENT2];
+        goto resume;
+    }
     
     // Create sockets
     if((server1_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -393,141 +1308,137 @@ int main() {
         exit(EXIT_FAILURE);
     }
     
-    // Accept connections
-    int addrlen = sizeof(addr1);
-    if((client1_fd = accept(server1_fd, (struct sockaddr *)&addr1, (socklen_t*)&addrlen)) < 0) {
+    // A new server process connects here to take over the match. It is
+    // created first so that a running server is detected here, before the
+    // player socket probes below could be mistaken for a player connecting.
+    if((handoff_fd = open_unix_listener(HANDOFF_SOCK_PATH, "Handoff socket")) >= 0) {
+        // A peer that vanishes between poll() and accept() mustn't block us
+        fcntl(handoff_fd, F_SETFL, fcntl(handoff_fd, F_GETFL) | O_NONBLOCK);
+    }
+    
+    // Same-host clients may connect over Unix-domain sockets instead of TCP
+    // loopback; the protocol on both transports is identical
+    unix1_fd = open_unix_listener(PLAYER1_SOCK_PATH, "Unix socket 1");
+    unix2_fd = open_unix_listener(PLAYER2_SOCK_PATH, "Unix socket 2");
+    
+    // Same-host clients connecting here talk over shared-memory rings
+    // instead; the socket only hands them the rings and reports hangups
+    shm1_fd = open_unix_listener(PLAYER1_SHM_PATH, "Shared-memory socket 1");
+    shm2_fd = open_unix_listener(PLAYER2_SHM_PATH, "Shared-memory socket 2");
+    
+resume:
+    // Accept connections; after a takeover only the missing ones
+    if(client1_fd < 0 &&
+       (client1_fd = accept_player(&conns[0], server1_fd, unix1_fd, shm1_fd, handoff_fd)) < 0) {
+        if(client1_fd == ACCEPT_HANDOFF) goto handoff;
         perror("Accept 1 failed");
         exit(EXIT_FAILURE);
     }
-    if((client2_fd = accept(server2_fd, (struct sockaddr *)&addr2, (socklen_t*)&addrlen)) < 0) {
+    if(client2_fd < 0 &&
+       (client2_fd = accept_player(&conns[1], server2_fd, unix2_fd, shm2_fd, handoff_fd)) < 0) {
+        if(client2_fd == ACCEPT_HANDOFF) goto handoff;
         perror("Accept 2 failed");
         exit(EXIT_FAILURE);
     }
+    conns[0].fd = client1_fd;
+    conns[1].fd = client2_fd;
     
-      // Modified Begin phase for Player 1
-    while(1) {
-        int width, height;
-        char extra;
-        memset(buffer, 0, BUFFER_SIZE);
-        read(client1_fd, buffer, BUFFER_SIZE);
-        
-        if(buffer[0] == 'F') {
-            send(client1_fd, "H 0", 3, 0);
-            send(client2_fd, "H 1", 3, 0);
-            goto cleanup;
+    // Begin and Initialize run concurrently: each player's connection
+    // advances through its own setup phases as its packets arrive
+    while(conns[0].phase != PHASE_READY || conns[1].phase != PHASE_READY) {
+        struct pollfd fds[5];
+        int timeout = -1;
+        for(int i = 0; i < 2; i++) {
+            // A player's Initialize can't be parsed until player 1's Begin
+            // has sized the boards, so leave it queued in the socket until then
+            int waiting = conns[i].phase == PHASE_READY ||
+                          (conns[i].phase == PHASE_INITIALIZE && player1_state == NULL);
+            if(!waiting) {
+                int wait_ms = token_wait_ms(&conns[i]);
+                if(wait_ms > 0) {
+                    waiting = 1;
+                    if(timeout < 0 || wait_ms < timeout) timeout = wait_ms;
+                }
+            }
+            watch_connection(&conns[i], &fds[2 * i], !waiting);
         }
+        fds[4].fd = handoff_fd;
+        fds[4].events = POLLIN;
+        fds[4].revents = 0;
         
-        if(buffer[0] != 'B') {
-            send(client1_fd, "E 100", 5, 0);
-            continue;
+        if(poll(fds, 5, timeout) < 0) {
+            perror("Poll failed");
+            goto cleanup;
         }
         
-        int params = sscanf(buffer, "B %d %d%c", &width, &height, &extra);
-        if(params != 2 || buffer[1] != ' ') {
-            send(client1_fd, "E 200", 5, 0);
-            continue;
+        if(fds[4].revents & POLLIN) {
+            goto handoff;
         }
         
-        if(width < 10 || height < 10) {
-            send(client1_fd, "E 200", 5, 0);
-            continue;
+        for(int i = 0; i < 2; i++) {
+            if(fds[2 * i].revents == 0 && fds[2 * i + 1].revents == 0) continue;
+            if(handle_setup_packet(&conns[i], &conns[1 - i], &player1_state, &player2_state,
+                                   ship_moves, buffer, &fds[2 * i]) < 0) {
+                goto cleanup;
+            }
         }
-        
-        player1_state = create_game_state(width, height);
-        player2_state = create_game_state(width, height);
-        send(client1_fd, "A", 1, 0);
-        break;
     }
-
-    // Modified Begin phase for Player 2
+    
+    // Main game loop
     while(1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        read(client2_fd, buffer, BUFFER_SIZE);
+        Connection* conn = &conns[current_player - 1];
+        Connection* other = &conns[2 - current_player];
+        GameState* target_state = (current_player == 1) ? player2_state : player1_state;
         
-        if(buffer[0] == 'F') {
-            send(client2_fd, "H 0", 3, 0);
-            send(client1_fd, "H 1", 3, 0);
-            goto cleanup;
+        // Take handoff requests between packets, while the next one is
+        // still safely queued in the client's socket. A player over the
+        // rate limit isn't read from until it has a token again.
+        int wait_ms = token_wait_ms(conn);
+        struct pollfd fds[3];
+        watch_connection(conn, fds, wait_ms == 0);
+        fds[2].fd = handoff_fd;
+        fds[2].events = POLLIN;
+        fds[2].revents = 0;
+        if(poll(fds, 3, wait_ms > 0 ? wait_ms : -1) < 0) {
+            perror("Poll failed");
+            break;
         }
-        
-        if(buffer[0] != 'B') {
-            send(client2_fd, "E 100", 5, 0);
-            continue;
+        if(fds[2].revents & POLLIN) {
+            goto handoff;
         }
-        
-        if(strlen(buffer) > 1) {
-            send(client2_fd, "E 200", 5, 0);
+        if(fds[0].revents == 0 && fds[1].revents == 0) {
             continue;
         }
         
-        send(client2_fd, "A", 1, 0);
-        break;
-    }
-
-    // Modified Initialize phase for Player 1
-    while(1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_read = read(client1_fd, buffer, BUFFER_SIZE - 1);
-        if(bytes_read <= 0) {
-            goto cleanup;
-        }
-        buffer[bytes_read] = '\0';
-        
-        if(strcmp(buffer, "F") == 0) {
-            send(client1_fd, "H 0", 3, 0);
-            send(client2_fd, "H 1", 3, 0);
-            goto cleanup;
+        int read_result = read_packet(conn, buffer, fds);
+        if(read_result < 0) {
+            send_packet(other, "H 1", 3);  // The player disconnected
+            break;
         }
-        
-        int result = handle_initialize(client1_fd, player1_state, ship_moves, buffer);
-        if(result == 0) break;  // Successfully initialized
-    }
-
-    // Modified Initialize phase for Player 2
-    while(1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_read = read(client2_fd, buffer, BUFFER_SIZE - 1);
-        if(bytes_read <= 0) {
-            goto cleanup;
+        if(read_result == 0) {
+            continue;
         }
-        buffer[bytes_read] = '\0';
         
-        if(strcmp(buffer, "F") == 0) {
-            send(client2_fd, "H 0", 3, 0);
-            send(client1_fd, "H 1", 3, 0);
-            goto cleanup;
+        if(check_error_limit(conn, other)) {
+            break;
         }
         
-        int result = handle_initialize(client2_fd, player2_state, ship_moves, buffer);
-        if(result == 0) break;  // Successfully initialized
-    }
-    
-    // Main game loop
-    int current_player = 1;  // Start with player 1
-    char response[BUFFER_SIZE];
-    
-    while(1) {
-        int client_fd = (current_player == 1) ? client1_fd : client2_fd;
-        GameState* target_state = (current_player == 1) ? player2_state : player1_state;
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        read(client_fd, buffer, BUFFER_SIZE);
-        
         // Handle forfeit
         if(buffer[0] == 'F') {
-            send(client_fd, "H 0", 3, 0);
-            send((current_player == 1) ? client2_fd : client1_fd, "H 1", 3, 0);
+            send_packet(conn, "H 0", 3);
+            send_packet(other, "H 1", 3);
             break;
         }
         
         // Handle query
         if(buffer[0] == 'Q') {
             if(strlen(buffer) != 1) {
-                send(client_fd, "E 102", 5, 0);
+                send_error(conn, "E 102");
                 continue;
             }
+            conn->consecutive_errors = 0;
             char* query_response = create_query_response(target_state);
-            send(client_fd, query_response, strlen(query_response), 0);
+            send_packet(conn, query_response, strlen(query_response));
             free(query_response);
             continue;
         }
@@ -538,23 +1449,24 @@ if(buffer[0] == 'S') {
     char extra;
     
     if(sscanf(buffer, "S %d %d%c", &row, &col, &extra) != 2) {
-        send(client_fd, "E 202", 5, 0);
+        send_error(conn, "E 202");
         continue;
     }
     
     int result = process_shot(target_state, row, col);
     
     if(result == 400) {
-        send(client_fd, "E 400", 5, 0);
+        send_error(conn, "E 400");
         continue;
     }
     
     if(result == 401) {
-        send(client_fd, "E 401", 5, 0);
+        send_error(conn, "E 401");
         continue;
     }
     
     // Send shot response
+    conn->consecutive_errors = 0;
     char msg[8];
     memset(msg, 0, sizeof(msg));
     if(result == -1) { // Hit
@@ -562,22 +1474,15 @@ if(buffer[0] == 'S') {
     } else { // Miss
         sprintf(msg, "R %d M", target_state->ships_remaining);
     }
-    send(client_fd, msg, strlen(msg), 0);
+    send_packet(conn, msg, strlen(msg));
 
     // If game is over, let next read handle the win condition
     if(target_state->ships_remaining == 0) {
-        int next_fd = (current_player == 1) ? client2_fd : client1_fd;
-        memset(buffer, 0, BUFFER_SIZE);
-        read(next_fd, buffer, BUFFER_SIZE);  // Wait for next read
+        wait_packet(other, buffer);  // Wait for next read
         
         // Now send halt packets
-        if(current_player == 1) {
-            send(client2_fd, "H 0", 3, 0);
-            send(client1_fd, "H 1", 3, 0);
-        } else {
-            send(client1_fd, "H 0", 3, 0);
-            send(client2_fd, "H 1", 3, 0);
-        }
+        send_packet(other, "H 0", 3);
+        send_packet(conn, "H 1", 3);
         goto cleanup;
     }
     
@@ -586,10 +1491,16 @@ if(buffer[0] == 'S') {
 }
         
         // Invalid packet type
-        send(client_fd, "E 102", 5, 0);
+        send_error(conn, "E 102");
     }
     
 cleanup:
+    // After a handoff the counters carry on in the new process
+    if(!handed_off) {
+        print_connection_stats(&conns[0]);
+        print_connection_stats(&conns[1]);
+    }
+    
     // Cleanup resources
     if(player1_state) free_game_state(player1_state);
     if(player2_state) free_game_state(player2_state);
@@ -598,6 +1509,32 @@ cleanup:
     close(client2_fd);
     close(server1_fd);
     close(server2_fd);
+    if(unix1_fd >= 0) close(unix1_fd);
+    if(unix2_fd >= 0) close(unix2_fd);
+    if(shm1_fd >= 0) close(shm1_fd);
+    if(shm2_fd >= 0) close(shm2_fd);
+    if(handoff_fd >= 0) close(handoff_fd);
+    close_shm_channel(&conns[0]);
+    close_shm_channel(&conns[1]);
     
     return 0;
+    
+handoff:
+    // Pass the match to the new server process; our copies of the sockets
+    // are closed on exit without affecting it
+    {
+        int fds[HANDOFF_FD_COUNT] = {
+            server1_fd, server2_fd, unix1_fd, unix2_fd, shm1_fd, shm2_fd, handoff_fd,
+            client1_fd, client2_fd,
+            conns[0].shm_fd, conns[0].rx_event_fd, conns[0].tx_event_fd,
+            conns[1].shm_fd, conns[1].rx_event_fd, conns[1].tx_event_fd
+        };
+        if(send_handoff(handoff_fd, fds, player1_state, player2_state, conns, current_player) < 0) {
+            fprintf(stderr, "[Server] Handoff failed, continuing match\n");
+            goto resume;
+        }
+        fprintf(stderr, "[Server] Match handed off\n");
+        handed_off = 1;
+    }
+    goto cleanup;
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "shm_ring.h"
+
+#define PORT1 2201
+#define PORT2 2202
+#define SOCK_PATH1 "/tmp/hw4_player1.sock"
+#define SOCK_PATH2 "/tmp/hw4_player2.sock"
+#define SHM_PATH1 "/tmp/hw4_player1_shm.sock"
+#define SHM_PATH2 "/tmp/hw4_player2_shm.sock"
+#define BUFFER_SIZE 1024
+#define BOARD_SIZE 1000
+#define DEFAULT_SHOTS 100000
+
+enum { TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_SHM };
+
+typedef struct {
+    int fd;
+    ShmChannel* channel;  // Non-NULL for the shared-memory transport
+    int to_server_event;
+    int to_client_event;
+} BenchClient;
+
+int connect_unix(const char* path) {
+    struct sockaddr_un serv_addr;
+    int client_fd;
+
+    if ((client_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("[Bench] socket() failed.");
+        exit(EXIT_FAILURE);
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strncpy(serv_addr.sun_path, path, sizeof(serv_addr.sun_path) - 1);
+    if (connect(client_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("[Bench] connect() failed.");
+        exit(EXIT_FAILURE);
+    }
+    return client_fd;
+}
+
+// The server answers a shared-memory connection with the ring memory and the
+// two eventfds, in that order, before any packet is exchanged
+void attach_ring(BenchClient* client) {
+    int passed[3];
+    char control[CMSG_SPACE(sizeof(passed))];
+    char tag;
+    struct iovec iov = { &tag, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg;
+    if (recvmsg(client->fd, &msg, 0) != 1 || tag != 'R' || (msg.msg_flags & MSG_CTRUNC) ||
+        (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(passed))) {
+        fprintf(stderr, "[Bench] Server did not hand over a ring\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(passed, CMSG_DATA(cmsg), sizeof(passed));
+
+    client->channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, passed[0], 0);
+    if (client->channel == MAP_FAILED) {
+        perror("[Bench] mmap() failed.");
+        exit(EXIT_FAILURE);
+    }
+    close(passed[0]);
+    client->to_server_event = passed[1];
+    client->to_client_event = passed[2];
+}
+
+// Connect to the server over TCP loopback, the Unix-domain socket, or the
+// shared-memory ring
+BenchClient connect_player(int player, int transport) {
+    BenchClient client = { -1, NULL, -1, -1 };
+
+    if (transport == TRANSPORT_UNIX) {
+        client.fd = connect_unix(player == 1 ? SOCK_PATH1 : SOCK_PATH2);
+        return client;
+    }
+    if (transport == TRANSPORT_SHM) {
+        client.fd = connect_unix(player == 1 ? SHM_PATH1 : SHM_PATH2);
+        attach_ring(&client);
+        return client;
+    }
+
+    struct sockaddr_in serv_addr;
+    if ((client.fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("[Bench] socket() failed.");
+        exit(EXIT_FAILURE);
+    }
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(player == 1 ? PORT1 : PORT2);
+    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
+        perror("[Bench] Invalid address/ Address not supported.");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(client.fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("[Bench] connect() failed.");
+        exit(EXIT_FAILURE);
+    }
+    return client;
+}
+
+void close_player(BenchClient* client) {
+    if (client->channel != NULL) {
+        munmap(client->channel, sizeof(ShmChannel));
+        close(client->to_server_event);
+        close(client->to_client_event);
+    }
+    close(client->fd);
+}
+
+// Send one packet and wait for the reply
+void exchange(BenchClient* client, const char* packet, char* buffer) {
+    memset(buffer, 0, BUFFER_SIZE);
+
+    if (client->channel == NULL) {
+        send(client->fd, packet, strlen(packet), 0);
+        if (read(client->fd, buffer, BUFFER_SIZE - 1) <= 0) {
+            perror("[Bench] read() failed.");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    uint64_t count = 1;
+    if (shm_ring_push(&client->channel->to_server, packet, strlen(packet)) < 0 ||
+        write(client->to_server_event, &count, sizeof(count)) != sizeof(count)) {
+        perror("[Bench] Ring send failed.");
+        exit(EXIT_FAILURE);
+    }
+    // Blocks until the server announces a reply packet
+    if (read(client->to_client_event, &count, sizeof(count)) != sizeof(count) ||
+        shm_ring_pop(&client->channel->to_client, buffer, BUFFER_SIZE) < 0) {
+        perror("[Bench] Ring read failed.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Send one setup packet and require the server to accept it
+void setup_exchange(BenchClient* client, const char* packet, char* buffer) {
+    exchange(client, packet, buffer);
+    if (strcmp(buffer, "A") != 0) {
+        fprintf(stderr, "[Bench] Setup packet %s rejected: %s\n", packet, buffer);
+        exit(EXIT_FAILURE);
+    }
+}
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Plays both sides of one match against the server, firing misses only so the
+// game never ends, and reports per-shot round-trip latency and throughput.
+// A default server build throttles each connection to its rate limit, so
+// build it with -DRATE_LIMIT_PER_SEC=0 to measure the transport itself. Run
+// once against each transport to compare them:
+//   ./player_bench tcp [shots]
+//   ./player_bench unix [shots]
+//   ./player_bench shm [shots]
+int main(int argc, char **argv) {
+    const char* names[] = { "tcp", "unix", "shm" };
+    int transport = TRANSPORT_TCP;
+    if (argc > 1) {
+        while (transport <= TRANSPORT_SHM && strcmp(argv[1], names[transport]) != 0) transport++;
+        if (transport > TRANSPORT_SHM) {
+            fprintf(stderr, "[Bench] transport must be tcp, unix or shm\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int shots = argc > 2 ? atoi(argv[2]) : DEFAULT_SHOTS;
+    int max_shots = (BOARD_SIZE - 10) * BOARD_SIZE;
+    char buffer[BUFFER_SIZE] = {0};
+    char packet[64];
+
+    if (shots <= 0 || shots > max_shots) {
+        fprintf(stderr, "[Bench] shots must be between 1 and %d\n", max_shots);
+        exit(EXIT_FAILURE);
+    }
+
+    double* latency = malloc(2 * shots * sizeof(double));
+    if (latency == NULL) {
+        perror("[Bench] malloc() failed.");
+        exit(EXIT_FAILURE);
+    }
+    BenchClient client1 = connect_player(1, transport);
+    BenchClient client2 = connect_player(2, transport);
+
+    sprintf(packet, "B %d %d", BOARD_SIZE, BOARD_SIZE);
+    setup_exchange(&client1, packet, buffer);
+    setup_exchange(&client2, "B", buffer);
+    setup_exchange(&client1, "I 1 1 0 0 1 1 0 2 1 1 0 4 1 1 2 2 1 1 2 0", buffer);
+    setup_exchange(&client2, "I 1 1 0 0 1 1 0 2 1 1 0 4 1 1 2 2 1 1 2 0", buffer);
+
+    // Ships occupy the first few rows, so shots from row 10 onward always miss
+    double start = now_us();
+    for (int i = 0; i < 2 * shots; i++) {
+        int cell = i / 2;
+        sprintf(packet, "S %d %d", 10 + cell / BOARD_SIZE, cell % BOARD_SIZE);
+        double sent = now_us();
+        exchange(i % 2 == 0 ? &client1 : &client2, packet, buffer);
+        latency[i] = now_us() - sent;
+        if (buffer[0] != 'R') {
+            fprintf(stderr, "[Bench] Unexpected reply to %s: %s\n", packet, buffer);
+            exit(EXIT_FAILURE);
+        }
+    }
+    double elapsed = now_us() - start;
+
+    exchange(&client1, "F", buffer);
+    close_player(&client1);
+    close_player(&client2);
+
+    qsort(latency, 2 * shots, sizeof(double), compare_doubles);
+    printf("[Bench] transport: %s\n", names[transport]);
+    printf("[Bench] shots: %d\n", 2 * shots);
+    printf("[Bench] latency avg: %.2f us\n", elapsed / (2 * shots));
+    printf("[Bench] latency p50: %.2f us\n", latency[shots]);
+    printf("[Bench] latency p99: %.2f us\n", latency[(int)(2 * shots * 0.99)]);
+    printf("[Bench] shots/sec: %.0f\n", 2 * shots / (elapsed / 1e6));
+
+    free(latency);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+// Single-producer single-consumer ring of length-prefixed packets, kept in
+// memory shared between the server and one same-host client. Each packet
+// written is announced with one eventfd count, so one wakeup is one packet.
+#define SHM_RING_SIZE 65536  // Bytes; must be a power of two
+
+typedef struct {
+    _Atomic uint32_t head;  // Total bytes ever written; only the producer stores it
+    char head_pad[60];      // Keep head and tail on separate cache lines
+    _Atomic uint32_t tail;  // Total bytes ever read; only the consumer stores it
+    char tail_pad[60];
+    unsigned char data[SHM_RING_SIZE];
+} ShmRing;
+
+// One ring per direction
+typedef struct {
+    ShmRing to_server;
+    ShmRing to_client;
+} ShmChannel;
+
+static inline void shm_ring_copy_in(ShmRing* ring, uint32_t pos, const void* src, uint32_t length) {
+    uint32_t offset = pos & (SHM_RING_SIZE - 1);
+    uint32_t first = SHM_RING_SIZE - offset;
+    if(first > length) first = length;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char*)src + first, length - first);
+}
+
+static inline void shm_ring_copy_out(ShmRing* ring, uint32_t pos, void* dst, uint32_t length) {
+    uint32_t offset = pos & (SHM_RING_SIZE - 1);
+    uint32_t first = SHM_RING_SIZE - offset;
+    if(first > length) first = length;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char*)dst + first, ring->data, length - first);
+}
+
+// Queue one packet. Returns -1 if it doesn't fit in the free space.
+static inline int shm_ring_push(ShmRing* ring, const char* packet, uint32_t length) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t used = head - tail;
+
+    // The other side can scribble on shared memory, so never trust used
+    if(used > SHM_RING_SIZE || length > SHM_RING_SIZE - used - sizeof(length) ||
+       SHM_RING_SIZE - used < sizeof(length)) {
+        return -1;
+    }
+
+    shm_ring_copy_in(ring, head, &length, sizeof(length));
+    shm_ring_copy_in(ring, head + sizeof(length), packet, length);
+    atomic_store_explicit(&ring->head, head + sizeof(length) + length, memory_order_release);
+    return 0;
+}
+
+// Dequeue one packet into buffer as a NUL-terminated string, truncated to
+// capacity - 1 bytes. Returns its length, -1 if the ring is empty, or -2 if
+// the ring holds something that isn't a whole packet.
+static inline int shm_ring_pop(ShmRing* ring, char* buffer, uint32_t capacity) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t used = head - tail;
+    uint32_t length;
+
+    if(used == 0) {
+        return -1;
+    }
+    if(used > SHM_RING_SIZE || used < sizeof(length)) {
+        return -2;
+    }
+
+    shm_ring_copy_out(ring, tail, &length, sizeof(length));
+    if(length > used - sizeof(length)) {
+        return -2;
+    }
+
+    uint32_t kept = length < capacity ? length : capacity - 1;
+    shm_ring_copy_out(ring, tail + sizeof(length), buffer, kept);
+    buffer[kept] = '\0';
+    atomic_store_explicit(&ring->tail, tail + sizeof(length) + length, memory_order_release);
+    return (int)kept;
+}
+
+#endif